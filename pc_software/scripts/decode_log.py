@@ -33,6 +33,7 @@ class RadiationLog(object):
 		self.scaling = 0
 		self.logId = 0
 		self.samples = []
+		self.sampleLens = [] # in seconds, for each sample
 		self.sampleLen = 15
 		self.start = None
 		self.timingBy = "none"
@@ -44,14 +45,48 @@ class RadiationLog(object):
 		self.timemult = 1
 		self.timeunit = "minutes"
 	
-	def _parseDataFromGeigerCounter(self, line1, line2, line3):
-		n = 0
-		self.logId, self.resolution, self.scaling, n = map(int, line1.strip().split(','))
-		samples = map(int, line2.strip().split(','))
+	def _parseSamples(self, line, n, scaling):
+		samples = []
+		if line.strip():
+			samples = map(int, line.strip().split(','))
 		if n != len(samples):
-			raise DumpDataError(fn, "Indicated number of samples doesn't match the actual list!")
-		self.samples = map(lambda x: x * 2**self.scaling, samples)
+			raise DumpDataError(self.filename, "Indicated number of samples doesn't match the actual list!")
+		return map(lambda x: x * 2**scaling, samples)
+	
+	def _overlayTier(self, resolution, start, samples):
+		"""Replaces the tail of the log with the samples of a finer tier."""
+		sampleLen = 15 * 2**resolution
+		tierStart = start * sampleLen
+		# keep the samples which begin before the tier does, and only use
+		# the tier's samples after the last of them:
+		t = 0
+		i = 0
+		while i < len(self.samples) and t < tierStart:
+			t += self.sampleLens[i]
+			i += 1
+		del self.samples[i:]
+		del self.sampleLens[i:]
+		for j in xrange(len(samples)):
+			if tierStart + j * sampleLen >= t:
+				self.samples.append(samples[j])
+				self.sampleLens.append(sampleLen)
+	
+	def _parseDataFromGeigerCounter(self, lines):
+		n = 0
+		self.logId, self.resolution, self.scaling, n = map(int, lines[0].strip().split(','))
+		self.samples = self._parseSamples(lines[1], n, self.scaling)
 		self.sampleLen = 15 * 2**self.resolution
+		self.sampleLens = [self.sampleLen] * len(self.samples)
+		# the mid and fine tiers (log_file_format 2), if present:
+		lastResolution = self.resolution
+		for i in [3, 5]:
+			if len(lines) <= i + 1 or not lines[i].strip():
+				break
+			resolution, scaling, start, n = map(int, lines[i].strip().split(','))
+			samples = self._parseSamples(lines[i + 1], n, scaling)
+			if resolution < lastResolution:
+				self._overlayTier(resolution, start, samples)
+				lastResolution = resolution
 		# determine X axis value:
 		self.timemult, self.timeunit = self.determineXAxis()
 	
@@ -62,7 +97,7 @@ class RadiationLog(object):
 	
 	def _parseLogHeaderField(self, field, data):
 		if field == "log_file_format":
-			if data != "1":
+			if data not in ["1", "2"]:
 				return "Unsupported log file format version"
 		elif field == "title":
 			self.title = data
@@ -97,12 +132,12 @@ class RadiationLog(object):
 						f.close()
 						return status
 		f.close()
-		assert len(deviceLines) >= 3, "File too short (expecting 3 lines after REELOG)"
-		self._parseDataFromGeigerCounter(deviceLines[0], deviceLines[1], deviceLines[2])
+		assert len(deviceLines) >= 3, "File too short (expecting at least 3 lines after REELOG)"
+		self._parseDataFromGeigerCounter(deviceLines)
 		return ""
 
 	def determineXAxis(self):
-		totalMinutes = len(self.samples) * self.sampleLen
+		totalMinutes = self.getTotalTime()
 		scaling = 1.0 / 60
 		if totalMinutes * scaling < 500: # less than 500 minutes, or ~8 hours:
 			return scaling, "minutes"
@@ -122,14 +157,23 @@ class RadiationLog(object):
 		self.counts_to_sv = self.cpm_to_svh / 60.0
 
 	def getIntensityForSample(self, index):
-		return (self.samples[index] / (self.sampleLen / 60.0)) * (self.cpm_to_svh * 10**6)
+		return (self.samples[index] / (self.sampleLens[index] / 60.0)) * (self.cpm_to_svh * 10**6)
 
 	def getTotalTime(self):
-		return len(self.samples) * self.sampleLen
+		return sum(self.sampleLens)
 
 	def getSampleLength(self):
 		return self.sampleLen
 	
+	def getSampleTimes(self):
+		"""Returns the start time (in seconds since the log start) of each sample"""
+		times = []
+		t = 0
+		for sampleLen in self.sampleLens:
+			times.append(t)
+			t += sampleLen
+		return times
+	
 	def getTotalDose(self):
 		return sum(self.samples) * self.counts_to_sv
 	
@@ -156,12 +200,13 @@ def readFileData(fn):
 def exportDataToGNUPlot(data, plot, useMinutes):
 	plot.write("#\t%s\tRadiation\n" % (useMinutes and data.timeunit or "%"))
 	
+	times = data.getSampleTimes()
 	for i in xrange(len(data.samples)):
 		R = data.getIntensityForSample(i)
 		if useMinutes:
-			s = i * data.getSampleLength() * data.timemult
+			s = times[i] * data.timemult
 		else:
-			s = 100.0 * i / float(len(data.samples) - 1)
+			s = 100.0 * times[i] / float(times[-1])
 		plot.write("\t%.4f %.3f\n" % (s, R))
 	plot.close()
 
@@ -27,7 +27,7 @@ LOG FILE FORMAT:
 
 A typical log file looks like (without the "====" sentinels):
 =================================
-log_file_format: 1
+log_file_format: 2
 title: Log #15 from device #161
 sn: 161
 start: 2020-04-06 03:43
@@ -38,18 +38,20 @@ tube_factor_used: 0.00570
 *
 LINE1
 LINE2
-LINE3
+...
+LINE8
 =================================
 
 Where:
- - log_file_format: describes the exact format of this log file, currently 1.
+ - log_file_format: describes the exact format of this log file, currently 2. Format 1 is the same, but has only
+                    three data lines (no mid and fine tiers), as produced by devices with protocol version < 45.
  - timing_by: whether the log timing was given by its start (more accurate) or end (less accurate)
  - tube_factor_dev: tube sensitivity as given by the device (e.g. if the GETTM cmd returns 57/100, this will be 0.00570)
  - tube_factor_used: tube sensitivity, as you've calibrated it. Will be used as the authoritative number by decode_log
                      and other utilities. download_log will write it the same as tube_factor_dev, but you can change
                      it later.
- - LINE1, LINE2, LINE3: the actual log data, verbatim from what comes from the geiger counter device (result of RSLOG or
-                        REELOG commands).
+ - LINE1, LINE2, ...: the actual log data, verbatim from what comes from the geiger counter device (result of the
+                      REELOG command).
 """
 
 class LogFile(object):
@@ -66,6 +68,7 @@ class LogFile(object):
 		self.tubeFactorUsed = 0.0
 		self.dataLength = 0 # in seconds
 		self.lines = []
+		self.format = 2
 		self.outFile = ""
 	
 	def defaultOutFile(self):
@@ -84,7 +87,7 @@ class LogFile(object):
 		if not f:
 			print "Cannot serialize, write error!"
 			return False
-		f.write("log_file_format: 1\n")
+		f.write("log_file_format: %d\n" % self.format)
 		f.write("title: %s\n" % self.title)
 		f.write("sn: %03d\n" % self.sn)
 		f.write(self.start.strftime("start: %Y-%m-%d %H:%M\n"))
@@ -179,9 +182,11 @@ def main(args):
 	ser.read_all()
 	
 	# try "HELO"
-	if cmd(ser, "HELO")[:5] != "O HAI":
+	greeting = cmd(ser, "HELO")
+	if greeting[:5] != "O HAI":
 		print "Cannot connect: device does not respond to greeting"
 		return
+	protocolVersion = int(greeting.split(',')[2])
 	
 	devSn = int(cmd(ser, "GETID"))
 	
@@ -196,10 +201,18 @@ def main(args):
 	f.tubeNum, f.tubeDen = map(int, cmd(ser, "GETTM").split('/'))
 	f.tubeFactorDev = f.tubeNum / float(f.tubeDen) / 100.0
 	f.tubeFactorUsed = f.tubeFactorDev
-	f.lines = cmd(ser, "REELOG", 3)
+	if protocolVersion >= 45:
+		f.lines = cmd(ser, "REELOG", 8)
+	else:
+		f.lines = cmd(ser, "REELOG", 3)
+		f.format = 1
 	items = f.lines[0].split(',')
 	f.logid = int(items[0])
 	f.dataLength = 15 * 2**int(items[1]) * int(items[3])
+	# the finer tiers may extend a bit past the end of the coarse one:
+	for header in f.lines[3:7:2]:
+		res, scaling, start, n = map(int, header.split(','))
+		f.dataLength = max(f.dataLength, 15 * 2**res * (start + n))
 	if f.start:
 		f.end = f.start + datetime.timedelta(seconds=f.dataLength)
 	else:
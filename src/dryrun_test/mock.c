@@ -61,6 +61,31 @@ void eeprom_update_word(uint16_t* addr, uint16_t value)
 	fclose(f);
 }
 
+void eeprom_read_block(void* dst, const void* addr, unsigned size)
+{
+	FILE* f = open_eeprom();
+	fseek(f, (unsigned) (uint64_t) addr, SEEK_SET);
+	fread(dst, 1, size, f);
+	fclose(f);
+}
+
+void eeprom_update_block(const void* src, void* addr, unsigned size)
+{
+	FILE* f = open_eeprom();
+	fseek(f, (unsigned) (uint64_t) addr, SEEK_SET);
+	fwrite(src, 1, size, f);
+	fclose(f);
+}
+
+// same as the one in avr-libc's <util/crc16.h>
+uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t data)
+{
+	crc ^= data;
+	for (int i = 0; i < 8; i++)
+		crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+	return crc;
+}
+
 uint16_t battery_get_voltage(void)
 {
 	return battery_baseline + rand() % 45;   
@@ -21,6 +21,11 @@ uint16_t eeprom_read_word(uint16_t* address);
 void eeprom_update_byte(uint8_t* address, uint8_t data);
 void eeprom_update_word(uint16_t* address, uint16_t data);
 
+void eeprom_read_block(void* dst, const void* address, unsigned size);
+void eeprom_update_block(const void* src, void* address, unsigned size);
+
+uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t data);
+
 uint8_t mock_UDR0(void);
 
 #define UDR0 mock_UDR0()
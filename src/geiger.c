@@ -532,7 +532,7 @@ static void show_battery_voltage(void)
 
 uint8_t row_show_id;
 
-static void show_eelog_value(uint16_t counts)
+static void show_eelog_value(uint32_t counts)
 {
 	if (row_show_id >= 2) return;
 	display_counts(counts);
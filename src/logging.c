@@ -28,8 +28,10 @@
 #	include <avr/pgmspace.h>	// tools used to store variables in program memory
 #	include <avr/sleep.h>		// sleep mode utilities
 #	include <util/delay.h>		// some convenient delay functions
+#	include <util/crc16.h>		// for _crc8_ccitt_update()
 #	include <avr/eeprom.h>     // for read/write to EEPROM memory
 #endif
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include "pinout.h"
@@ -38,115 +40,771 @@
 #include "nvram_map.h"
 #include "logging.h"
 
+/*
+ * The EEPROM log is kept in three tiers, each covering the log with its own
+ * resolution:
+ *
+ *  - the coarse tier (ADDR_log_GM): the whole log, from its very beginning.
+ *    When it fills up, shrink_buffer() halves its resolution;
+ *  - the mid tier (ADDR_log_mid): a ring of 16-minute samples, covering the
+ *    last 15 hours or so;
+ *  - the fine tier (ADDR_log_fine): a ring of 30-second samples, covering
+ *    the last hour or so.
+ *
+ * All three are fed with the same 30-second data points, so a sample flows
+ * into every tier as it comes, and ages out of the finer tiers when their
+ * rings wrap around.
+ *
+ * All tiers store their samples in 32-byte blocks (struct LogBlock), which
+ * are compressed (see code_sample()), so a block holds between 10 and 185
+ * samples, depending on how noisy the data is.
+ *
+ * Each sample of the coarse and mid tiers also carries the stats of the
+ * 30-second counts it sums up (struct Stats), so that short events are still
+ * visible in the long-term log.
+ *
+ * The ring blocks carry the index of their first sample and a CRC, so the
+ * rings need no bookkeeping in the log header. The mid tier block being
+ * filled is written on each new sample; the fine tier one only on every 8th,
+ * as it fills up too quickly (its last few minutes are lost on a power cut,
+ * but this saves EEPROM wear).
+ */
 enum {
 	SRAMLOG_LENGTH =  40,  // 40 * 30 secs = 20 minutes.
-	EELOG_LENGTH   = 240,
+	LOGHDR_VERSION =   4,  // bump this if struct LogHeader/LogBlock change
+	BLOCK_BITS     = 200,  // size of LogBlock::data, in bits
+	BLOCK_SAMPLES  = 185,  // max samples in a block (16 bits + 1 bit each)
+	FINE_BLOCKS    =   4,
+	FINE_FLUSH     =   7,  // write the fine tier block every 8 samples
+	MID_BLOCKS     =   3,
+	MID_RES        =   6,  // 15 * 2**6 secs = 16 minutes.
+	COARSE_BLOCKS  =   6,  // + 1 spare one, used by shrink_buffer()
+};
+
+/*
+ * Sample compression. The samples of a block are coded as a bitstream (MSB
+ * first), where:
+ *
+ *  - the first sample is written as a raw 16-bit value;
+ *  - each following sample x is written as a Rice code of its difference to
+ *    the running mean of the block: zigzag(x - mean) = q * 2**k + rem, and
+ *    the code is q ones, a zero, and rem in k bits. `k' grows with the mean
+ *    (see rice_k()), as the spread of GM counts is about sqrt(mean);
+ *  - if q is CODE_ESCAPE or more, the code is CODE_ESCAPE ones, followed by
+ *    x as a raw 16-bit value, which also restarts the running mean.
+ *
+ * The running mean is updated as mean += (x - mean) / 4 after each sample.
+ *
+ * In tiers with res > 1, each sample is followed by its stats, coded against
+ * m, the mean 30-second count of the sample (see tick_mean()): the excess of
+ * the peak over m as a Rice code with k = rice_k(m) + 1, then the spread with
+ * k = rice_k(m). Escapes are the same, with the value itself following.
+ * Both are in the order of sqrt(m) for a steady source, so they take about as
+ * much space as the sample itself.
+ */
+enum {
+	CODE_ESCAPE    =  16,
+};
+
+// in-place rewrites of the coarse tier, which may be interrupted by a power
+// loss and need to be finished on the next boot:
+enum {
+	FIX_NONE    = 0x00,
+	FIX_SHRINK  = 0x40, // building new coarse block `fix_pos' (see run_shrink())
+	FIX_COPY    = 0x80, // copying the spare block to coarse block `fix_pos'
+	FIX_OP_MASK = 0xc0, // the low 6 bits hold the scaling of fix_value
+};
+
+/*
+ * The EEPROM log header. There are two copies of it (ADDR_log_hdr0 and
+ * ADDR_log_hdr1), which are written alternately, so a power cut while one of
+ * them is being written leaves the other intact. On boot, the copy with a
+ * valid CRC and a newer `seq' wins. The CRC is seeded with LOGHDR_VERSION, so
+ * a header from an incompatible firmware never validates.
+ *
+ * The header is committed after each sample added to the coarse tier, so the
+ * coarse blocks need no CRC of their own. shrink_buffer() rewrites the coarse
+ * blocks in place, committing the header at each step, so that after a power
+ * cut logging_init() can finish the job (see run_shrink()).
+ */
+struct LogHeader {
+	uint16_t id;        // see struct LogInfo
+	uint16_t length;    // # of samples in the coarse tier
+	uint16_t fix_value; // shrink_buffer(): the sample which didn't fit...
+	uint16_t fix_peak;  // ...and its stats
+	uint16_t fix_spread;
+	uint8_t  res;
+	uint8_t  head;      // last coarse block in use
+	uint8_t  fix_op;    // FIX_NONE, or FIX_SHRINK/FIX_COPY | fix_value scaling
+	uint8_t  fix_pos;   // coarse block being rewritten
+	uint8_t  seq;       // incremented on each write
+	uint8_t  crc;
+};
+
+struct LogBlock {
+	uint32_t start;     // index of the first sample, counted from the start
+	                    // of the log, in units of the tier's sample length
+	uint8_t  count;     // number of samples in the block
+	uint8_t  scaling;   // sample scaling (value = x * 2**scaling)
+	uint8_t  crc;       // rings only; seeded with the log id, see block_crc()
+	uint8_t  data[BLOCK_BITS / 8];
+};
+
+// state of the bitstream of a block, while coding or decoding it:
+struct Coder {
+	uint8_t  bits;      // bits used so far
+	uint8_t  res;       // resolution of the samples; stats are coded if > 1
+	uint16_t mean;
+};
+
+// stats of the 30-second counts which make up a sample:
+struct Stats {
+	uint16_t peak;      // the highest 30-second count
+	uint16_t spread;    // mean absolute difference of consecutive 30-second
+	                    // counts (about 1.13 * sqrt(mean) for a steady source)
+};
+
+struct Ring {
+	uint16_t addr;         // EEPROM address of the first block
+	uint8_t  num_blocks;
+	uint8_t  res;          // same meaning as LogInfo::res
+	uint8_t  flush_mask;   // write `image' when (count & flush_mask) == 0
+	uint8_t  head;         // index of the block in `image'
+	uint16_t ticks;        // # of 30-second samples in `accum'
+	uint32_t accum;
+	uint32_t peak;         // stats of the samples in `accum'
+	uint32_t spread;       // (sum of the differences, see struct Stats)
+	struct Coder coder;
+	struct LogBlock image; // the block being filled
 };
 
 static struct LogInfo sram, eelog;
+static struct LogHeader hdr; // last committed header
+static struct Ring fine = { ADDR_log_fine, FINE_BLOCKS, 1, FINE_FLUSH };
+static struct Ring mid = { ADDR_log_mid, MID_BLOCKS, MID_RES, 0 };
+static struct LogBlock coarse; // the last coarse block
+static struct Coder coarse_coder;
 static uint32_t buffer[SRAMLOG_LENGTH]; // buffer for the SRAM log
 static uint32_t gm_accum; // accumulator
 static uint16_t gm_counts; // how many 30-second samples are in the accumulator
 static uint16_t gm_flush_amount;
+static uint32_t gm_peak, gm_spread; // stats of the accumulator
+static uint32_t gm_last; // the last 30-second sample
 
-static inline uint16_t readEE(uint8_t index)
+static inline uint32_t round_down(uint32_t x, uint8_t scaling)
 {
-	return nv_read_word(ADDR_log_GM + 2 * (uint16_t) index);
+	if (!scaling) return x;
+	return ((x >> (scaling - 1)) + 1) >> 1;
 }
 
-static void writeEE(uint8_t index, uint16_t value)
+static uint8_t crc8(uint8_t crc, const void* data, uint8_t size)
 {
-	nv_update_word(ADDR_log_GM + 2 * (uint16_t) index, value);
+	const uint8_t* p = (const uint8_t*) data;
+	while (size--)
+		crc = _crc8_ccitt_update(crc, *p++);
+	return crc;
 }
 
-static inline uint32_t round_down(uint32_t x, uint8_t scaling)
+static uint8_t header_crc(const struct LogHeader* h)
 {
-	if (!scaling) return x;
-	return ((x >> (scaling - 1)) + 1) >> 1;
+	return crc8(LOGHDR_VERSION, h, offsetof(struct LogHeader, crc));
 }
 
-static int get_eelog_length(void)
+// blocks are bound to their log, so stale blocks of a previous log in the
+// rings never validate:
+static uint8_t block_crc(const struct LogBlock* b)
 {
-	int len = 0;
-	while (len < EELOG_LENGTH && readEE(len) != 0)
-		len++;
-	return len;
+	uint8_t crc = crc8(LOGHDR_VERSION, &eelog.id, sizeof(eelog.id));
+	crc = crc8(crc, b, offsetof(struct LogBlock, crc));
+	return crc8(crc, b->data, sizeof(b->data));
 }
 
-static void write_nv_struct(void)
+static uint8_t rice_k(uint32_t mean)
 {
-	nv_update_word(ADDR_log_id, eelog.id);
-	nv_update_byte(ADDR_log_res, eelog.res);
-	nv_update_byte(ADDR_log_scaling, eelog.scaling);
+	uint8_t k = 0;
+	while (mean) {
+		mean >>= 1;
+		k++;
+	}
+	return k / 2;
 }
 
-static void shrink_buffer()
+static void put_bits(uint8_t* data, uint8_t pos, uint16_t value, uint8_t n)
 {
-	// EEPROM buffer is about to overflow. Subsample and decrease resolution:
-	uint8_t i;
+	while (n--) {
+		if ((value >> n) & 1)
+			data[pos / 8] |= 0x80 >> (pos % 8);
+		pos++;
+	}
+}
 
-	// one prepass to check for value summation overflow:
-	uint32_t max_sum = 0;
-	for (i = 0; i < EELOG_LENGTH/2; i++) {
-		uint32_t sum = (uint32_t) readEE(2 * i) + readEE(2 * i + 1);
-		if (sum > max_sum)
-			max_sum = sum;
+static uint16_t get_bits(const uint8_t* data, uint8_t pos, uint8_t n)
+{
+	uint16_t value = 0;
+	while (n--) {
+		value = (value << 1) | ((data[pos / 8] >> (7 - pos % 8)) & 1);
+		pos++;
 	}
+	return value;
+}
+
+// length of the Rice code of `v', in bits:
+static uint8_t rice_len(uint32_t v, uint8_t k)
+{
+	uint32_t q = v >> k;
+	return (q >= CODE_ESCAPE) ? CODE_ESCAPE + 16 : q + 1 + k;
+}
 
-	// see how much should we shift right to avoid overflow
-	// this is *very* rarely necessary:
-	uint8_t extra_shift = 0;
-	while (round_down(max_sum, extra_shift) > 0xffff) {
-		max_sum >>= 1;
-		extra_shift++;
+// writes the Rice code of `v' at `pos', or an escape followed by `raw'.
+// Returns the position past the code:
+static uint8_t put_rice(uint8_t* data, uint8_t pos, uint32_t v, uint8_t k, uint16_t raw)
+{
+	uint32_t q = v >> k;
+	if (q >= CODE_ESCAPE) {
+		put_bits(data, pos, 0xffff, CODE_ESCAPE);
+		put_bits(data, pos + CODE_ESCAPE, raw, 16);
+		return pos + CODE_ESCAPE + 16;
 	}
+	put_bits(data, pos, 0xffff, q);
+	// the zero terminating q is already there:
+	put_bits(data, pos + q + 1, v, k);
+	return pos + q + 1 + k;
+}
 
-	for (i = 0; i < EELOG_LENGTH/2; i++) {
-		// merge GM counts for two periods (plain sum):
-		uint32_t sum = (uint32_t) readEE(2 * i) + readEE(2 * i + 1);
-		writeEE(i, round_down(sum, extra_shift));
+// reads a Rice code at `*pos'. On an escape, returns the raw value which
+// follows, and sets `*raw':
+static uint32_t get_rice(const uint8_t* data, uint8_t* pos, uint8_t k, uint8_t* raw)
+{
+	uint8_t q = 0;
+	uint32_t v;
+
+	while (q < CODE_ESCAPE && get_bits(data, *pos, 1)) {
+		q++;
+		(*pos)++;
+	}
+	*raw = q == CODE_ESCAPE;
+	if (*raw) {
+		v = get_bits(data, *pos, 16);
+		*pos += 16;
+	} else {
+		v = ((uint32_t) q << k) | get_bits(data, *pos + 1, k);
+		*pos += 1 + k;
 	}
-	if (extra_shift)
-		eelog.scaling += extra_shift;
+	return v;
+}
+
+static void update_mean(struct Coder* c, uint16_t x, uint8_t restart)
+{
+	if (restart)
+		c->mean = x;
+	else
+		c->mean += ((int32_t) x - c->mean) / 4;
+}
 
-	// fill the now empty half with zeros:
-	for (i = EELOG_LENGTH / 2; i < EELOG_LENGTH; i++)
-		writeEE(i, 0);
+static void coder_reset(struct Coder* c, uint8_t res)
+{
+	c->bits = 0;
+	c->res = res;
+	c->mean = 0;
+}
+
+// the mean 30-second count in a sample:
+static inline uint32_t tick_mean(uint16_t x, uint8_t scaling, uint8_t res)
+{
+	return ((uint32_t) x << scaling) >> (res - 1);
+}
+
+static inline uint16_t clamp16(uint32_t x)
+{
+	return (x > 0xffff) ? 0xffff : x;
+}
+
+// the stats of a sample, from the peak and the sum of differences of the
+// 30-second counts in it:
+static void make_stats(struct Stats* st, uint32_t peak, uint32_t spread, uint8_t res)
+{
+	st->peak = clamp16(peak);
+	st->spread = clamp16(round_down(spread, res - 1));
+}
+
+// appends a sample to a block, which must have zeroes past the used bits.
+// `st' is only used if the coder has res > 1. Returns 0 if it doesn't fit:
+static uint8_t code_sample(struct LogBlock* b, struct Coder* c, uint16_t x,
+                           const struct Stats* st)
+{
+	uint8_t k = rice_k(c->mean), ks = 0, raw = 1, need = 16;
+	uint32_t zz = 0, excess = 0;
+
+	if (b->count) {
+		int32_t r = (int32_t) x - c->mean;
+		zz = (r < 0) ? -2 * r - 1 : 2 * r;
+		raw = (zz >> k) >= CODE_ESCAPE;
+		need = rice_len(zz, k);
+	}
+	if (c->res > 1) {
+		uint32_t m = tick_mean(x, b->scaling, c->res);
+		ks = rice_k(m);
+		excess = (st->peak > m) ? st->peak - m : 0;
+		need += rice_len(excess, ks + 1) + rice_len(st->spread, ks);
+	}
+	if (c->bits + need > BLOCK_BITS)
+		return 0;
+
+	if (b->count) {
+		c->bits = put_rice(b->data, c->bits, zz, k, x);
+	} else {
+		put_bits(b->data, c->bits, x, 16);
+		c->bits += 16;
+	}
+	if (c->res > 1) {
+		c->bits = put_rice(b->data, c->bits, excess, ks + 1, excess);
+		c->bits = put_rice(b->data, c->bits, st->spread, ks, st->spread);
+	}
+	b->count++;
+	update_mean(c, x, raw);
+	return 1;
+}
+
+// gets the next sample of a block, and its stats if the coder has res > 1.
+// `c' must be reset before the first one:
+static uint16_t decode_sample(const struct LogBlock* b, struct Coder* c, struct Stats* st)
+{
+	uint8_t raw = 1;
+	uint16_t x;
+
+	if (c->bits) {
+		uint32_t zz = get_rice(b->data, &c->bits, rice_k(c->mean), &raw);
+		if (raw)
+			x = zz;
+		else
+			x = c->mean + ((zz & 1) ? -(int32_t) (zz / 2) - 1 : zz / 2);
+	} else {
+		x = get_bits(b->data, 0, 16);
+		c->bits = 16;
+	}
+	update_mean(c, x, raw);
+	if (c->res > 1) {
+		uint32_t m = tick_mean(x, b->scaling, c->res);
+		uint8_t ks = rice_k(m);
+		uint32_t excess = get_rice(b->data, &c->bits, ks + 1, &raw);
+		st->peak = clamp16(m + excess);
+		st->spread = get_rice(b->data, &c->bits, ks, &raw);
+	}
+	return x;
+}
+
+// empties a block; the first sample will have index `start':
+static void block_reset(struct LogBlock* b, struct Coder* c, uint32_t start, uint8_t res)
+{
+	memset(b, 0, sizeof(*b));
+	coder_reset(c, res);
+	b->start = start;
+}
+
+// adds an aggregated value to a block. Returns 0 if it doesn't fit:
+static uint8_t block_put(struct LogBlock* b, struct Coder* c, uint32_t gm,
+                         const struct Stats* st)
+{
+	if (!b->count) {
+		while (round_down(gm, b->scaling) > 0xffff)
+			b->scaling++;
+	}
+	uint32_t x = round_down(gm, b->scaling);
+	if (x > 0xffff) return 0;
+	return code_sample(b, c, x, st);
+}
+
+// sends `count' samples of a block, scaled to `scaling', or, if `stats' is
+// set, their stats (as peak, spread pairs):
+static void block_fetch(const struct LogBlock* b, uint8_t count, uint8_t scaling,
+                        uint8_t res, uint8_t stats, PFNValue value_fn)
+{
+	struct Coder c;
+	struct Stats st;
+	uint16_t x;
+
+	coder_reset(&c, res);
+	while (count--) {
+		x = decode_sample(b, &c, &st);
+		if (stats) {
+			value_fn(st.peak);
+			value_fn(st.spread);
+		} else {
+			value_fn(round_down(x, scaling - b->scaling));
+		}
+	}
+}
+
+static uint16_t block_addr(const struct Ring* r, uint8_t index)
+{
+	return r->addr + index * sizeof(struct LogBlock);
+}
+
+// reads a block of a ring. Returns 0 if the block is not valid.
+static uint8_t read_block(const struct Ring* r, uint8_t index, struct LogBlock* b)
+{
+	nv_read_block(b, block_addr(r, index), sizeof(*b));
+	return b->count <= BLOCK_SAMPLES && b->crc == block_crc(b);
+}
+
+// writes the block being filled. The block is marked invalid for the duration
+// of the write, as the CRC alone is too weak to reliably catch a torn write:
+static void flush_block(struct Ring* r)
+{
+	uint16_t addr = block_addr(r, r->head);
+	uint8_t count = r->image.count;
+	r->image.crc = block_crc(&r->image);
+	r->image.count = 0xff;
+	nv_update_byte(addr + offsetof(struct LogBlock, count), 0xff);
+	nv_update_block(&r->image, addr, sizeof(r->image));
+	r->image.count = count;
+	nv_update_byte(addr + offsetof(struct LogBlock, count), count);
+}
+
+// empties the ring; the first sample will have index `start':
+static void ring_reset(struct Ring* r, uint32_t start)
+{
+	block_reset(&r->image, &r->coder, start, r->res);
+	r->head = 0;
+	r->ticks = 0;
+	r->accum = 0;
+	r->peak = 0;
+	r->spread = 0;
+}
+
+// empties the ring, also invalidating the blocks in EEPROM:
+static void ring_clear(struct Ring* r)
+{
+	ring_reset(r, 0);
+	for (r->head = r->num_blocks - 1; r->head > 0; r->head--)
+		flush_block(r);
+	flush_block(r);
+}
+
+// finds the newest block of a ring (after a restart):
+static void ring_init(struct Ring* r)
+{
+	struct LogBlock b;
+	ring_reset(r, 0);
+	for (uint8_t i = 0; i < r->num_blocks; i++) {
+		if (read_block(r, i, &b) && b.start + b.count > r->image.start + r->image.count) {
+			r->image = b;
+			r->head = i;
+		}
+	}
+}
+
+// adds a 30-second sample `gm', which differs by `diff' from the previous one:
+static void ring_add(struct Ring* r, uint32_t gm, uint32_t diff)
+{
+	r->accum += gm;
+	r->spread += diff;
+	if (gm > r->peak)
+		r->peak = gm;
+	if (++r->ticks < (1 << (r->res - 1))) return;
+
+	struct LogBlock* b = &r->image;
+	struct Stats st;
+	make_stats(&st, r->peak, r->spread, r->res);
+	if (!block_put(b, &r->coder, r->accum, &st)) {
+		// the current block is full; write it out and start a new one,
+		// overwriting the oldest block:
+		if (b->count & r->flush_mask)
+			flush_block(r);
+		if (++r->head == r->num_blocks)
+			r->head = 0;
+		block_reset(b, &r->coder, b->start + b->count, r->res);
+		block_put(b, &r->coder, r->accum, &st);
+	}
+	r->ticks = 0;
+	r->accum = 0;
+	r->peak = 0;
+	r->spread = 0;
+
+	if ((b->count & r->flush_mask) == 0)
+		flush_block(r);
+}
+
+// sends a ring's samples in the format described at logging_fetch_log():
+static void ring_fetch(const struct Ring* r, PFNValue value_fn, PFNLine endline)
+{
+	struct LogBlock b;
+	uint8_t i, oldest = r->head, scaling = r->image.scaling;
+	uint32_t start = r->image.start;
+
+	// walk back from the head, for as long as the blocks are contiguous:
+	for (uint8_t n = 1; n < r->num_blocks; n++) {
+		i = (oldest == 0) ? r->num_blocks - 1 : oldest - 1;
+		if (!read_block(r, i, &b) || b.start + b.count != start)
+			break;
+		oldest = i;
+		start = b.start;
+		if (b.scaling > scaling)
+			scaling = b.scaling;
+	}
+
+	value_fn(r->res);
+	value_fn(scaling);
+	value_fn(start);
+	value_fn(r->image.start + r->image.count - start);
+	endline();
+
+	// the samples, then their stats (none at res 1):
+	for (uint8_t stats = 0; stats < 2; stats++) {
+		for (i = oldest; !stats || r->res > 1; i = (i + 1 == r->num_blocks) ? 0 : i + 1) {
+			if (i == r->head)
+				b = r->image;
+			else
+				read_block(r, i, &b);
+			block_fetch(&b, b.count, scaling, r->res, stats, value_fn);
+			if (i == r->head) break;
+		}
+		endline();
+	}
+}
+
+static inline uint16_t coarse_addr(uint8_t index)
+{
+	return ADDR_log_GM + index * sizeof(struct LogBlock);
+}
+
+// reads a coarse block. The header is the authority on the length of the
+// last block, as it's not rewritten on each sample:
+static void read_coarse(uint8_t index, struct LogBlock* b)
+{
+	nv_read_block(b, coarse_addr(index), sizeof(*b));
+	if (index == hdr.head)
+		b->count = eelog.length - b->start;
+}
+
+// the coarsest scaling of the coarse blocks, which all samples are brought to
+// when the log is fetched:
+static uint8_t coarse_scaling(void)
+{
+	uint8_t scaling = 0;
+	for (uint8_t i = 0; i <= hdr.head; i++) {
+		uint8_t s = nv_read_byte(coarse_addr(i) + offsetof(struct LogBlock, scaling));
+		if (s > scaling)
+			scaling = s;
+	}
+	return scaling;
+}
+
+static uint8_t read_header(uint16_t addr, struct LogHeader* h)
+{
+	nv_read_block(h, addr, sizeof(*h));
+	return h->crc == header_crc(h);
+}
+
+// commits eelog and the fixup state (hdr.head, hdr.fix_*) to the older
+// header slot:
+static void write_nv_struct(void)
+{
+	hdr.id = eelog.id;
+	hdr.res = eelog.res;
+	hdr.length = eelog.length;
+	hdr.seq++;
+	hdr.crc = header_crc(&hdr);
+	nv_update_block(&hdr, (hdr.seq & 1) ? ADDR_log_hdr1 : ADDR_log_hdr0, sizeof(hdr));
+}
+
+// sequential reader of the coarse tier samples, for shrink_buffer():
+struct Reader {
+	struct LogBlock b;
+	struct Coder c;
+	uint8_t block;      // coarse block in `b'
+	uint8_t pos;        // samples of `b' read so far
+	uint32_t peak;      // stats of the last sample read (see struct Ring)
+	uint32_t spread;
+	uint32_t last;      // the last sample read, at res 1
+};
+
+// gets the next sample, at its full value:
+static uint32_t reader_next(struct Reader* r)
+{
+	struct Stats st;
+	uint32_t x;
+
+	if (r->pos == r->b.count) {
+		read_coarse(++r->block, &r->b);
+		coder_reset(&r->c, eelog.res);
+		r->pos = 0;
+	}
+	r->pos++;
+	x = (uint32_t) decode_sample(&r->b, &r->c, &st) << r->b.scaling;
+	if (eelog.res > 1) {
+		r->peak = st.peak;
+		r->spread = (uint32_t) st.spread << (eelog.res - 1);
+	} else {
+		// 30-second samples carry no stats; make them up:
+		r->peak = x;
+		r->spread = (x > r->last) ? x - r->last : r->last - x;
+		r->last = x;
+	}
+	return x;
+}
+
+// positions the reader at sample `index', which is in coarse block `block'
+// or a later one:
+static void reader_seek(struct Reader* r, uint8_t block, uint32_t index)
+{
+	read_coarse(block, &r->b);
+	while (r->b.start + r->b.count <= index)
+		read_coarse(++block, &r->b);
+	r->block = block;
+	coder_reset(&r->c, eelog.res);
+	r->pos = 0;
+	// the sample before the block is unknown, so the spread of the first one
+	// is lost (only when going from res 1 to 2):
+	r->last = get_bits(r->b.data, 0, 16) << r->b.scaling;
+	while (r->b.start + r->pos < index)
+		reader_next(r);
+}
+
+/*
+ * Runs (or resumes) shrink_buffer(), starting from the new coarse block `i'.
+ *
+ * The samples are paired (2*j and 2*j+1) and the sums are coded into new
+ * blocks, filling each one as far as it goes. Merging adds about half a bit
+ * per sample, so the new blocks take up a bit over half the space. Still, the
+ * new block `i' must at least reach the end of the old block `i', which it
+ * overwrites; if it doesn't fit at that, it gets coarser scaling.
+ *
+ * Each new block is put in the spare block first, then copied to its place,
+ * with a header commit after each step. The block being built only needs the
+ * old blocks from `i' on, so after a power cut it can be built again.
+ */
+static void run_shrink(uint8_t i)
+{
+	struct Reader rd;
+	struct LogBlock b;
+	struct Stats st;
+	uint8_t shift = hdr.fix_op & ~FIX_OP_MASK;
+	uint32_t length = eelog.length, m = 0, first = 0, end, x;
+	uint32_t peak, peak2, spread;
+
+	if (i) {
+		nv_read_block(&b, coarse_addr(i - 1), sizeof(b));
+		m = b.start + b.count;
+	}
+	for (; 2 * m < length; i++) {
+		uint8_t scaling = 0;
+		read_coarse(i, &b);
+		end = b.start + b.count;
+		first = m;
+	retry:
+		block_reset(&coarse, &coarse_coder, first, eelog.res + 1);
+		coarse.scaling = scaling;
+		reader_seek(&rd, i, 2 * first);
+		for (m = first; 2 * m < length; m++) {
+			x = reader_next(&rd);
+			peak = rd.peak;
+			spread = rd.spread;
+			if (2 * m + 1 < length) {
+				x += reader_next(&rd);
+				peak2 = rd.peak;
+				spread += rd.spread;
+			} else {
+				// see shrink_buffer():
+				x += (uint32_t) hdr.fix_value << shift;
+				peak2 = hdr.fix_peak;
+				spread += (uint32_t) hdr.fix_spread << (eelog.res - 1);
+			}
+			if (peak2 > peak)
+				peak = peak2;
+			make_stats(&st, peak, spread, eelog.res + 1);
+			x = round_down(x, scaling);
+			if (x > 0xffff || !code_sample(&coarse, &coarse_coder, x, &st)) {
+				if (2 * m < end || !coarse.count) {
+					scaling++;
+					goto retry;
+				}
+				break;
+			}
+		}
+		nv_update_block(&coarse, coarse_addr(COARSE_BLOCKS), sizeof(coarse));
+		hdr.fix_op = FIX_COPY | shift;
+		hdr.fix_pos = i;
+		write_nv_struct();
+		nv_update_block(&coarse, coarse_addr(i), sizeof(coarse));
+		hdr.fix_op = FIX_SHRINK | shift;
+		hdr.fix_pos = i + 1;
+		write_nv_struct();
+	}
 
-	// increment the "resolution" flag and double the num samples per flush:
 	eelog.res++;
-	write_nv_struct(); // update EEPROM as well
+	eelog.length = m;
+	hdr.head = i - 1;
+	hdr.fix_op = FIX_NONE;
+	write_nv_struct();
+}
+
+static void shrink_buffer(uint32_t gm, const struct Stats* st)
+{
+	// EEPROM buffer is full. Subsample and decrease resolution. With an odd
+	// number of samples, the last one pairs with the sample that didn't fit
+	// (gm), so that goes to the header; otherwise, it goes to the accumulator,
+	// to make the first half of the next sample:
+	uint8_t shift = 0;
+	if (eelog.length & 1) {
+		while (round_down(gm, shift) > 0xffff)
+			shift++;
+		hdr.fix_value = round_down(gm, shift);
+		hdr.fix_peak = st->peak;
+		hdr.fix_spread = st->spread;
+	} else {
+		gm_accum = gm;
+		gm_counts = gm_flush_amount;
+		gm_peak = st->peak;
+		gm_spread = (uint32_t) st->spread << (eelog.res - 1);
+	}
+	hdr.fix_op = FIX_SHRINK | shift;
+	hdr.fix_pos = 0;
+	write_nv_struct();
+	run_shrink(0);
+
+	// double the num samples per flush:
 	gm_flush_amount *= 2;
-	// reset the length:
-	eelog.length = EELOG_LENGTH / 2;
 }
 
+static void add_sample_coarse(uint32_t gm, const struct Stats* st)
+{
+	if (!block_put(&coarse, &coarse_coder, gm, st)) {
+		if (hdr.head == COARSE_BLOCKS - 1) {
+			shrink_buffer(gm, st);
+			return;
+		}
+		// the last block is full; start a new one:
+		hdr.head++;
+		block_reset(&coarse, &coarse_coder, eelog.length, eelog.res);
+		block_put(&coarse, &coarse_coder, gm, st);
+	}
+	nv_update_block(&coarse, coarse_addr(hdr.head), sizeof(coarse));
+	eelog.length++;
+	write_nv_struct();
+}
 
 static void add_sample_eeprom(uint32_t gm)
 {
+	uint32_t diff = (gm > gm_last) ? gm - gm_last : gm_last - gm;
+	gm_last = gm;
+
+	ring_add(&fine, gm, diff);
+	ring_add(&mid, gm, diff);
+
 	gm_accum += gm; gm_counts++;
+	gm_spread += diff;
+	if (gm > gm_peak)
+		gm_peak = gm;
 	if (gm_counts == gm_flush_amount) {
-		gm_accum = round_down(gm_accum, eelog.scaling);
-		if (gm_accum > 0xffff) {
-			uint8_t extra_shift = 1;
-			while (round_down(gm_accum, extra_shift) > 0xffff)
-				extra_shift++;
-			
-			for (uint8_t i = 0; i < eelog.length; i++)
-				writeEE(i, round_down(readEE(i), extra_shift));
-			
-			eelog.scaling += extra_shift;
-			gm_accum = round_down(gm_accum, extra_shift);
-			nv_update_byte(ADDR_log_scaling, eelog.scaling);
-		}
-		writeEE(eelog.length, gm_accum);
+		uint32_t x = gm_accum;
+		struct Stats st;
+		make_stats(&st, gm_peak, gm_spread, eelog.res);
 		gm_counts = 0;
 		gm_accum = 0;
-
-		eelog.length++;
-
-		if (eelog.length == EELOG_LENGTH) 
-			shrink_buffer();
+		gm_peak = 0;
+		gm_spread = 0;
+		add_sample_coarse(x, &st);
 	}
 }
 
@@ -156,27 +814,21 @@ static void add_sample_sram(uint32_t gm)
 		buffer[sram.length++] = gm;
 	} else {
 		// SRAM log overflow; transfer to EEPROM and mark them as copies of
-		// each other:
-		uint32_t max_sample = 0;
-		for (uint8_t i = 0; i < SRAMLOG_LENGTH; i++)
-			if (buffer[i] > max_sample)
-				max_sample = buffer[i];
-
-		uint8_t ee_scaling = 0;
-		while (round_down(max_sample, ee_scaling) > 0xffff) {
-			ee_scaling++;
-		}
-		// write to EEPROM buffer:
-		for (uint8_t i = 0; i < SRAMLOG_LENGTH; i++)
-			writeEE(i, round_down(buffer[i], ee_scaling));
-
-		// write zeros to the rest:
-		for (uint8_t i = SRAMLOG_LENGTH; i < EELOG_LENGTH; i++)
-			writeEE(i, 0);
-
+		// each other. The old EEPROM log is about to be overwritten; drop it
+		// first, so that a power cut in the middle can't present a half-baked
+		// log:
 		eelog = sram;
-		eelog.scaling = ee_scaling;
+		eelog.length = 0;
+		hdr.head = 0;
 		write_nv_struct();
+		block_reset(&coarse, &coarse_coder, 0, eelog.res);
+
+		// write to EEPROM buffer, and to the rings:
+		ring_reset(&fine, 0);
+		ring_reset(&mid, 0);
+		gm_last = buffer[0];
+		for (uint8_t i = 0; i < SRAMLOG_LENGTH; i++)
+			add_sample_eeprom(buffer[i]);
 
 		add_sample_eeprom(gm);
 	}
@@ -184,21 +836,54 @@ static void add_sample_sram(uint32_t gm)
 
 void logging_init(void)
 {
-	eelog.id = nv_read_word(ADDR_log_id);
-	if (eelog.id == 65535) {
-		// assume NVRAM is filled with ones; clear that up:
-		for (uint16_t i = 1; i < 512; i++)
-			nv_update_byte(i, 0);
+	struct LogHeader h1;
+	uint8_t ok0 = read_header(ADDR_log_hdr0, &hdr);
+	uint8_t ok1 = read_header(ADDR_log_hdr1, &h1);
+	// pick the newer of the valid slots:
+	if (ok1 && (!ok0 || (uint8_t) (h1.seq - hdr.seq) == 1))
+		hdr = h1;
+
+	if (ok0 || ok1) {
+		eelog.id = hdr.id;
+		eelog.res = hdr.res;
+		eelog.length = hdr.length;
+		if (hdr.fix_op & FIX_COPY) {
+			// we lost power in the middle of shrink_buffer(), with a new block
+			// in the spare one; copy it and go on:
+			nv_read_block(&coarse, coarse_addr(COARSE_BLOCKS), sizeof(coarse));
+			nv_update_block(&coarse, coarse_addr(hdr.fix_pos), sizeof(coarse));
+			hdr.fix_op ^= FIX_COPY | FIX_SHRINK;
+			hdr.fix_pos++;
+			write_nv_struct();
+		}
+		if (hdr.fix_op & FIX_SHRINK) {
+			// finish the shrink_buffer() job:
+			run_shrink(hdr.fix_pos);
+		}
+	} else {
+		if (nv_read_word(ADDR_log_hdr0) == 0xffff) {
+			// assume NVRAM is filled with ones; clear that up:
+			for (uint16_t i = 1; i < 512; i++)
+				nv_update_byte(i, 0);
+		}
+		// no valid log header (fresh EEPROM, or an older firmware), start
+		// with an empty log:
+		memset(&hdr, 0, sizeof(hdr));
+		eelog.id = 0;
+		eelog.res = 1;
+		eelog.length = 0;
+		write_nv_struct();
 	}
-	eelog.length = get_eelog_length();
-	eelog.scaling = 0;
-	eelog.res = nv_read_byte(ADDR_log_res);
+	ring_init(&fine);
+	ring_init(&mid);
+
 	sram.id = eelog.id + 1; // increment log id
 	sram.length = 0;
 	sram.scaling = 0;
 	sram.res = 1; // 30 second samples
 
 	gm_accum = gm_counts = 0;
+	gm_peak = gm_spread = 0;
 	gm_flush_amount = 1;
 }
 
@@ -213,20 +898,26 @@ void logging_add_data_point(uint32_t gm)
 
 void logging_get_info(LogEntry log_entry, struct LogInfo* log_info)
 {
-	if (log_entry == LOG_SRAM)
+	if (log_entry == LOG_SRAM) {
 		*log_info = sram;
-	else
+	} else {
 		*log_info = eelog;
+		log_info->scaling = coarse_scaling();
+	}
 }
 
 void logging_reset_all(void)
 {
-	// zero EEPROM memory:
-	uint8_t i;
-	nv_update_byte(ADDR_log_res, 1);
-	for (i = 0; i < EELOG_LENGTH; i++)
-		nv_update_word(ADDR_log_GM + 2 * i, 0);
+	// empty the EEPROM log (the samples themselves needn't be erased, the
+	// header holds the length):
+	eelog.res = 1;
+	eelog.length = 0;
+	hdr.head = 0;
+	hdr.fix_op = FIX_NONE;
+	write_nv_struct();
 	memset(buffer, 0, sizeof(buffer));
+	ring_clear(&fine);
+	ring_clear(&mid);
 
 	// reset structures:
 	logging_init();
@@ -234,16 +925,32 @@ void logging_reset_all(void)
 
 void logging_fetch_log(LogEntry log_entry, PFNValue value_fn, PFNLine endline)
 {
-	const struct LogInfo* log = (log_entry == LOG_SRAM) ? &sram : &eelog;
+	struct LogInfo log;
 	uint8_t i;
 
-	value_fn(log->id);
-	value_fn(log->res);
-	value_fn(log->scaling);
-	value_fn(log->length);
+	logging_get_info(log_entry, &log);
+	value_fn(log.id);
+	value_fn(log.res);
+	value_fn(log.scaling);
+	value_fn(log.length);
 	endline();
 
-	for (i = 0; i < log->length; i++)
-		value_fn((log_entry == LOG_SRAM) ? buffer[i] : readEE(i));
-	endline();
+	if (log_entry == LOG_SRAM) {
+		for (i = 0; i < log.length; i++)
+			value_fn(buffer[i]);
+		endline();
+	} else {
+		// the samples, then their stats (none at res 1):
+		struct LogBlock b;
+		for (uint8_t stats = 0; stats < 2; stats++) {
+			for (i = 0; i <= hdr.head && (!stats || log.res > 1); i++) {
+				read_coarse(i, &b);
+				block_fetch(&b, b.count, log.scaling, log.res, stats, value_fn);
+			}
+			endline();
+		}
+
+		ring_fetch(&mid, value_fn, endline);
+		ring_fetch(&fine, value_fn, endline);
+	}
 }
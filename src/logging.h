@@ -29,7 +29,7 @@ struct LogInfo {
 	uint16_t id; // log ID (number)
 	uint8_t res; // resolution (length of sample; length = 15 * 2**res). res > 0.
 	uint8_t scaling; // sample scaling (value of each sample = x * 2**scaling).
-	uint16_t length; // number of samples [0..240]
+	uint16_t length; // number of samples
 };
 
 typedef enum {
@@ -50,7 +50,7 @@ void logging_add_data_point(uint32_t gm);
 // reset both logs
 void logging_reset_all(void);
 
-typedef void (*PFNValue) (uint16_t x);
+typedef void (*PFNValue) (uint32_t x);
 typedef void (*PFNLine) (void);
 
 /**
@@ -62,9 +62,13 @@ typedef void (*PFNLine) (void);
  *                    of data points are already transmitted.
  *
  * The calling pattern will be:
- * <logId>, <resolution>, <# samples>, <<newline>>
+ * <logId>, <resolution>, <scaling>, <# samples>, <<newline>>
+ * <gm sample 1>, <gm sample 2>, ..., <gm sample n>, <<newline>>
+ *
+ * For the EEPROM log, this is followed by an empty line and then the mid and
+ * fine tiers, each as:
+ * <resolution>, <scaling>, <index of first sample>, <# samples>, <<newline>>
  * <gm sample 1>, <gm sample 2>, ..., <gm sample n>, <<newline>>
- * <v sample 1>, <v sample 2>, ..., <v sample m>, <<newline>>
  *
  * Where each <thing> denotes a call to the value function with a number,
  * and each <<newline>> denotes a call to the line function.
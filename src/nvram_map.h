@@ -31,6 +31,9 @@
 #define nv_read_word(addr) eeprom_read_word((uint16_t*) (intptr_t) (addr))
 #define nv_update_word(addr, value) eeprom_update_word((uint16_t*) (intptr_t) (addr), value)
 
+#define nv_read_block(dst, addr, size) eeprom_read_block(dst, (const void*) (intptr_t) (addr), size)
+#define nv_update_block(src, addr, size) eeprom_update_block(src, (void*) (intptr_t) (addr), size)
+
 enum NVRAMAddr {
 	ADDR_brightness  = 0,   // display brightness      : a 8-bit value
 	ADDR_settings    = 1,   // device settings bitfield: 8-bit value
@@ -40,10 +43,12 @@ enum NVRAMAddr {
 	ADDR_rad_limit   = 8,   // Alarm for rad. level    : 16-bit value
 	ADDR_dose_limit  = 10,  // Alarm for dose accum.   : 16-bit value
 	
-	ADDR_log_id      = 12,  // Log serial number (id)  : 16-bit value
-	ADDR_log_res     = 14,  // Log "resolution"        : 8-bit value
-	ADDR_log_scaling = 15,  // Log "scaling"           : 8-bit value
-	ADDR_log_GM      = 16,  // start of GM log         : 240 values of 16 bits
+	ADDR_log_hdr0    = 12,  // Log header, slot 0      : 16 bytes (see logging.c)
+	ADDR_log_hdr1    = 28,  // Log header, slot 1      : 16 bytes
+	ADDR_log_fine    = 44,  // GM log, fine tier ring  : 4 blocks of 32 bytes
+	ADDR_log_mid     = 172, // GM log, mid tier ring   : 3 blocks of 32 bytes
+	ADDR_log_GM      = 268, // GM log, coarse tier     : 6+1 blocks of 32 bytes
+	                        // 492..511: unused
 };
 
 enum SettingsBits {
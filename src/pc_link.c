@@ -24,7 +24,7 @@
 
 /**
  * @brief PC Link protocol description
- * @version 44
+ * @version 45
  * 
  * Version history:
  *   ver42: RSLOG/REELOG had an extra line after the main log, including
@@ -35,11 +35,13 @@
  *          and effort to maintain and process, so it was scrapped.
  *          Thus RSLOG/REELOG now output only three lines, the third being
  *          always empty.
+ *   ver45: REELOG outputs the mid and fine tiers of the EEPROM log after the
+ *          third line (see REELOG below). RSLOG is unchanged.
  *
  * 
  * Command: HELO
  * Description: Replies with firmware revision and protocol version.
- * Sample response: "O HAI,331,44"
+ * Sample response: "O HAI,336,45"
  * Synopsis: the first number is firmware revision, the second one is protocol
  *           version.
  * 
@@ -122,9 +124,36 @@
  *
  * Command: REELOG
  * Description: Read the EEPROM log.
- * Sample response: See RSLOG.
- * Synopsis: The same format as RSLOG, but it reads the EEPROM log. The length
- *           of the log can be max EELOG_LENGTH samples (240 currently).
+ * Sample response:
+ * """
+ *   14,5,0,47
+ *   171,165,180,...,172
+ *
+ *   6,0,30,17
+ *   43,41,45,...,44
+ *   1,0,552,72
+ *   1,2,0,...,1
+ *
+ * """
+ * Synopsis: The first three lines are in the same format as RSLOG, but they
+ *           give the coarse tier of the EEPROM log, which covers the entire
+ *           log, from its start. The samples are stored compressed, so how
+ *           many fit depends on the data (usually 150-300); the resolution is
+ *           reduced as needed to fit.
+ *
+ *           Then follow two more tiers, each in two lines - the mid one
+ *           (16-minute samples) and the fine one (30-second samples). They
+ *           only cover the most recent part of the log. The first line of a tier is "resolution,scaling,start,#samples",
+ *           where `start' is the index of the first sample, counting from the
+ *           start of the log, in units of the tier's resolution (i.e. the
+ *           tier's samples start at (start * 15 * 2^resolution) seconds into
+ *           the log). The second line holds the samples, with the same meaning
+ *           as in RSLOG.
+ *
+ *           The tiers are consistent with each other, so a host may replace
+ *           the tail of the coarse tier with the finer tiers' samples.
+ *           Note the fine tier is written in chunks of 8 samples, so up to
+ *           4 minutes of it may be missing if the device was restarted.
  * 
  * 
  * Command: GETID
@@ -308,7 +337,7 @@ void pc_link_init(void)
 
 static char first_item_in_line = 1;
 
-static void print_number_uint16(uint16_t x)
+static void print_number(uint32_t x)
 {
 	if (first_item_in_line)
 		first_item_in_line = 0;
@@ -460,7 +489,7 @@ int8_t interpret_command(const char* cmd)
 		case 0xD518:
 		{
 			//
-			uart_putstring_P(PSTR("O HAI," FIRMWARE_REVISION_STR ",44"));
+			uart_putstring_P(PSTR("O HAI," FIRMWARE_REVISION_STR ",45"));
 			//
 			return NORMAL;
 		}
@@ -478,7 +507,7 @@ int8_t interpret_command(const char* cmd)
 		case 0x7092:
 		{
 			//
-			logging_fetch_log(LOG_EEPROM, print_number_uint16, print_newline);
+			logging_fetch_log(LOG_EEPROM, print_number, print_newline);
 			//
 			return NORMAL;
 		}
@@ -498,7 +527,7 @@ int8_t interpret_command(const char* cmd)
 		case 0x0A93:
 		{
 			//
-			logging_fetch_log(LOG_SRAM, print_number_uint16, print_newline);
+			logging_fetch_log(LOG_SRAM, print_number, print_newline);
 			//
 			return NORMAL;
 		}